@@ -31,12 +31,26 @@
 #include <math.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <glob.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define MAX_STRING 500
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
 #define MAX_SENTENCE_LENGTH 1000
 #define MAX_CODE_LENGTH 40
+#define MAX_HEAD 32
+#define HUGE_PAGE_SIZE (2LL << 20)
+#define GIANT_PAGE_SIZE (1LL << 30)
+#define KNOWLEDGE_MAGIC "HWEKNF01"
+#define VOCAB_MAGIC "HWEVOC01"
+#define CORPUS_BUFFER_SIZE (1 << 16)
 
 const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
 
@@ -51,30 +65,122 @@ struct vocab_word {
   long long cn; //word count
   char *word;
   struct Node *List;
+  int isFeature; //0 is word, otherwise the feature head id
+};
+
+// Reader of the training data; reads the shards from the current one to last_shard as a single stream
+struct corpus_reader {
+  FILE *fin;
+  int shard, last_shard;
+  int pushback; // character pushed back by CorpusUngetc, or EOF
+  int eof;
+  z_stream *strm; // decompressor of gzip shards; NULL for plain text shards
+  unsigned char *in, *out;
+  unsigned int out_pos, out_len;
+  int in_member; // whether the gzip member being inflated has not reached its end
+  long long *member; // starts of the gzip members read so far, when indexing a shard read from its beginning
+  long long member_num, member_max;
+};
+
+// Vocabulary learnt from a part of the shards by LearnVocabThread
+struct vocab_learner {
+  struct vocab_word *vocab;
+  int *hash;
+  long long size, max_size, hash_size, bytes;
+  int min_reduce;
+  int *shard;
+  int shard_num;
+};
+
+// Header of a binary vocabulary snapshot; followed by entry[vocab_size], link[link_num],
+// the hash table vocab_hash[hash_size] and the string pool
+struct vocab_header {
+  char magic[8];
+  long long vocab_size, train_words, link_num, pool_size;
+  int feature_mode, feature_num, head_num, hash_size;
+};
+
+struct vocab_entry {
+  long long cn;
+  long long word;       // offset of the word in the string pool
+  long long link_begin; // features of the word are link[link_begin] ... link[link_begin + link_num - 1]
+  int link_num;
   int isFeature;
 };
 
+// Header of a compiled knowledge file; followed by feature[feature_num], edge_begin[feature_num + 1],
+// edge[edge_num] and the string pool
+struct knowledge_header {
+  char magic[8];
+  long long feature_num, edge_num, pool_size;
+  int hash_size; // vocab_hash_size used for the edge hashes
+};
+
+struct knowledge_edge {
+  long long word; // offset of the word in the string pool
+  int hash;       // hash value of the word
+};
+
+// Sense table of a knowledge file
+struct knowledge_table {
+  long long feature_num, edge_num, pool_size;
+  long long *feature;    // offset of the feature name in the string pool
+  long long *edge_begin; // words of the i-th feature are edge[edge_begin[i]] ... edge[edge_begin[i + 1] - 1]
+  struct knowledge_edge *edge;
+  char *pool;
+  int compiled;
+};
+
 char train_file[MAX_STRING], output_file[MAX_STRING];
 char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
 struct vocab_word *vocab;
-int binary = 0, debug_mode = 2, window = 5, min_count = 5, num_threads = 12, min_reduce = 1;
+int binary = 0, binary_vocab = 0, debug_mode = 2, window = 5, min_count = 5, num_threads = 12, min_reduce = 1;
 int *vocab_hash;
 long long vocab_max_size = 1000, vocab_size = 0, layer1_size = 100;
 long long train_words = 0, word_count_actual = 0, iter = 5, file_size = 0;
-real alpha = 0.025, starting_alpha, sample = 1e-3;
-real *syn0, *syn1neg, *expTable;
+char **train_shard;      // files of the training data
+long long *shard_offset; // offset of each shard in the concatenated training data; shard_offset[shard_num] is file_size
+int shard_num = 0;
+long long learner_hash_slots = 0; // hash table slots held by all the vocabulary learners, at most 2 * vocab_hash_size
+pthread_mutex_t learner_mutex = PTHREAD_MUTEX_INITIALIZER;
+long long **gzip_member;    // starts of the gzip members of each shard, recorded by the first full read
+long long *gzip_member_num; // -1 if not recorded yet
+int gzip_warned = 0;
+pthread_mutex_t gzip_mutex = PTHREAD_MUTEX_INITIALIZER, gzip_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+real alpha = 0.025, sample = 1e-3;
+real *expTable;
 clock_t start;
 
+// Model trained by TrainModelThread; a normal run trains a single model, the sweep mode trains several
+struct model {
+  char output_file[MAX_STRING];
+  long long layer1_size;
+  int window, negative, feature_mode;
+  real sample, alpha, starting_alpha;
+  real *syn0, *syn1neg;
+};
+
+char sweep_file[MAX_STRING];
+struct model *model;
+int model_num = 0;
+
 //feature hyper-parameter
-int feature_mode = 0;
+int feature_mode = 0; // 1 = sequential feature tag, 2 = global feature table, 3 = both
 long long _NULL = -1; // NULL feature id
-char knowledge_file[MAX_STRING];
+char knowledge_file[MAX_HEAD][MAX_STRING], compile_knowledge_file[MAX_STRING];
+int NumberOfKnowledgeFile = 0;
 int NumberOfFeature = 0;
+int NumberOfHead = 0; // feature heads are 1 (sequential feature tag, if any), then one per knowledge file
 
 int negative = 5;
 const int table_size = 1e7;
 int *table;
-int *Ftable;
+int **Ftable; // negative sampling table per feature head
+
+//memory hyper-parameter
+int hugepage_mode = 0;
+char mmap_dir[MAX_STRING];
+long long hot_rows = 100000;
 
 // Reutrn last delimiter index
 int lstrchar(char *str, char d) {
@@ -99,11 +205,144 @@ void substrncpy(char *target, char *source, int start, int end) {
   target[i - start] = 0;
 }
 
+#ifdef WIN32
+int posix_memalign(void **memptr,
+  size_t alignment,
+  size_t size) {
+  *memptr = _aligned_malloc(size, alignment);
+  if (errno != 0)
+    return errno;
+  else
+    return 0;
+}
+#endif
+
+// Maps a whole file into read-only memory
+void *MapFile(FILE *fin, long long size) {
+  void *ptr;
+#ifdef __linux__
+  ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fin), 0);
+  if (ptr == MAP_FAILED) { printf("Memory mapping failed\n"); exit(1); }
+#else
+  ptr = malloc(size);
+  if (ptr == NULL) { printf("Memory allocation failed\n"); exit(1); }
+  fseek(fin, 0, SEEK_SET);
+  fread(ptr, 1, size, fin);
+#endif
+  return ptr;
+}
+
+// Returns the size of a file
+long long GetFileSize(char *file) {
+  struct stat st;
+  if (stat(file, &st) != 0) return -1;
+  return st.st_size;
+}
+
+// Rounds size up to a multiple of align
+long long RoundUp(long long size, long long align) {
+  return (size + align - 1) / align * align;
+}
+
+// Returns whether transparent huge pages are disabled by the kernel
+int IsTHPDisabled() {
+  char mode[MAX_STRING];
+  int disabled = 0;
+  FILE *fin = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "rb");
+  if (fin == NULL) return 1;
+  if (fgets(mode, MAX_STRING, fin) != NULL && strstr(mode, "[never]") != NULL) disabled = 1;
+  fclose(fin);
+  return disabled;
+}
+
+// Allocates a large array, backed by huge pages if requested; falls back to smaller pages on failure
+void *AllocateArray(long long size, const char *name) {
+  void *ptr = NULL;
+  const char *backing = "4KB pages";
+#ifdef __linux__
+#ifdef MAP_HUGE_SHIFT
+  if (hugepage_mode >= 3 && size >= GIANT_PAGE_SIZE) {  // explicit 1GB pages, only for arrays filling one
+    ptr = mmap(NULL, RoundUp(size, GIANT_PAGE_SIZE), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0);
+    if (ptr == MAP_FAILED) ptr = NULL;
+    else backing = "explicit 1GB pages";
+  }
+  if (ptr == NULL && hugepage_mode >= 2) {  // explicit 2MB pages
+    ptr = mmap(NULL, RoundUp(size, HUGE_PAGE_SIZE), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+    if (ptr == MAP_FAILED) ptr = NULL;
+    else backing = "explicit 2MB pages";
+  }
+#endif
+  if (ptr == NULL && hugepage_mode >= 1) {  // transparent huge pages
+    if (posix_memalign(&ptr, HUGE_PAGE_SIZE, RoundUp(size, HUGE_PAGE_SIZE)) != 0) ptr = NULL;
+    else if (!IsTHPDisabled() && madvise(ptr, RoundUp(size, HUGE_PAGE_SIZE), MADV_HUGEPAGE) == 0) {
+      backing = "transparent 2MB pages";
+    }
+  }
+#endif
+  if (ptr == NULL && posix_memalign(&ptr, 128, size) != 0) ptr = NULL;
+  if (ptr == NULL) { printf("Memory allocation failed\n"); exit(1); }
+  if ((debug_mode > 0) && (hugepage_mode > 0)) printf("Allocated %s: %lldMB backed by %s\n", name, size >> 20, backing);
+  return ptr;
+}
+
+// Allocates a zero-filled matrix; with -mmap-dir, only the rows of the hot_rows most frequent words and of the
+// features are held in memory, and the other rows are mapped from a scratch file and paged in on demand
+real *AllocateMatrix(long long rows, long long row_size, const char *name) {
+  long long size = rows * row_size * sizeof(real), reserved, hot, cold_end;
+  char *base;
+  real *matrix;
+#ifdef __linux__
+  char file[MAX_STRING + 32];
+  int fd;
+  if (mmap_dir[0] != 0) {
+    hot = RoundUp((hot_rows < rows ? hot_rows : rows) * row_size * sizeof(real), HUGE_PAGE_SIZE);
+    cold_end = (rows - NumberOfFeature) * row_size * sizeof(real) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (hot < cold_end) {
+      // Reserve the address space, then place the hot rows, the cold rows and the feature rows in it
+      reserved = RoundUp(size, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+      base = (char *)mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (base == MAP_FAILED) { printf("Memory mapping failed\n"); exit(1); }
+      base = (char *)RoundUp((long long)base, HUGE_PAGE_SIZE);
+      sprintf(file, "%s/hwe-%s-XXXXXX", mmap_dir, name);
+      fd = mkstemp(file);
+      if (fd == -1 || ftruncate(fd, size) != 0) {
+        printf("ERROR: cannot create the scratch file in %s!\n", mmap_dir);
+        exit(1);
+      }
+      if ((hot > 0 && mmap(base, hot, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) ||
+          mmap(base + hot, cold_end - hot, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, hot) == MAP_FAILED ||
+          (cold_end < size && mmap(base + cold_end, RoundUp(size, HUGE_PAGE_SIZE) - cold_end, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)) {
+        printf("Memory mapping failed\n");
+        exit(1);
+      }
+      // The scratch file is removed once mapped, and lives until the end of the process
+      close(fd);
+      unlink(file);
+      if (hugepage_mode > 0) {
+        if (hot > 0) madvise(base, hot, MADV_HUGEPAGE);
+        if (cold_end < size) madvise(base + cold_end, RoundUp(size, HUGE_PAGE_SIZE) - cold_end, MADV_HUGEPAGE);
+      }
+      madvise(base + hot, cold_end - hot, MADV_RANDOM);
+      if (debug_mode > 0) printf("Allocated %s: %lldMB in memory, %lldMB mapped from %s\n", name,
+                                 (size - (cold_end - hot)) >> 20, (cold_end - hot) >> 20, mmap_dir);
+      return (real *)base;
+    }
+  }
+#endif
+  matrix = (real *)AllocateArray(size, name);
+  memset(matrix, 0, size);
+  return matrix;
+}
+
 void InitUnigramTable() {
   int a, i;
   double train_words_pow = 0;
   double d1, power = 0.75;
-  table = (int *)malloc(table_size * sizeof(int));
+  table = (int *)AllocateArray(table_size * sizeof(int), "table");
   for (a = 0; a < vocab_size - NumberOfFeature; a++) train_words_pow += pow(vocab[a].cn, power);
   i = 0;
   d1 = pow(vocab[i].cn, power) / train_words_pow;
@@ -116,22 +355,37 @@ void InitUnigramTable() {
     if (i >= vocab_size - NumberOfFeature) i = vocab_size - NumberOfFeature - 1;
   }
   if (feature_mode) {
-    train_words_pow = 0;
-    Ftable = (int *)malloc(table_size * sizeof(int));
-    for (a = vocab_size - NumberOfFeature; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
-    i = vocab_size - NumberOfFeature;
-    d1 = pow(vocab[i].cn, power) / train_words_pow;
-    for (a = 0; a < table_size; a++) {
-      Ftable[a] = i;
-      if (a / (double)table_size > d1) {
-        i++;
-        d1 += pow(vocab[i].cn, power) / train_words_pow;
+    int h, begin = vocab_size - NumberOfFeature, end;
+    char name[MAX_STRING];
+    Ftable = (int **)calloc(NumberOfHead + 1, sizeof(int *));
+    for (h = 1; h <= NumberOfHead; h++) {
+      // Features are grouped by head after SortVocab
+      for (end = begin; end < vocab_size && vocab[end].isFeature == h; end++);
+      if (end == begin) continue;
+      train_words_pow = 0;
+      sprintf(name, "Ftable[%d]", h);
+      Ftable[h] = (int *)AllocateArray(table_size * sizeof(int), name);
+      for (a = begin; a < end; a++) train_words_pow += pow(vocab[a].cn, power);
+      i = begin;
+      d1 = pow(vocab[i].cn, power) / train_words_pow;
+      for (a = 0; a < table_size; a++) {
+        Ftable[h][a] = i;
+        if (a / (double)table_size > d1) {
+          i++;
+          d1 += pow(vocab[i].cn, power) / train_words_pow;
+        }
+        if (i >= end) i = end - 1;
       }
-      if (i >= vocab_size) i = vocab_size - 1;
+      begin = end;
     }
   }
 }
 
+// Returns the feature head id of the k-th knowledge file
+int KnowledgeHead(int k) {
+  return (feature_mode & 1) + 1 + k;
+}
+
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
 void ReadWord(char *word, FILE *fin) {
   int a = 0, ch;
@@ -155,6 +409,294 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
+// Adds a file to the training data
+void AddTrainShard(char *file) {
+  struct stat st;
+  if (stat(file, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return; // empty files have no offset of their own
+  train_shard = (char **)realloc(train_shard, (shard_num + 1) * sizeof(char *));
+  shard_offset = (long long *)realloc(shard_offset, (shard_num + 2) * sizeof(long long));
+  train_shard[shard_num] = (char *)calloc(strlen(file) + 1, sizeof(char));
+  strcpy(train_shard[shard_num], file);
+  gzip_member = (long long **)realloc(gzip_member, (shard_num + 1) * sizeof(long long *));
+  gzip_member_num = (long long *)realloc(gzip_member_num, (shard_num + 1) * sizeof(long long));
+  gzip_member[shard_num] = NULL;
+  gzip_member_num[shard_num] = -1;
+  if (shard_num == 0) shard_offset[0] = 0;
+  shard_offset[shard_num + 1] = shard_offset[shard_num] + st.st_size;
+  shard_num++;
+}
+
+// Finds the files of the training data; train_file is a file, a directory, a glob pattern or @<file list>
+void FindTrainShards() {
+  char pattern[MAX_STRING + 2], file[MAX_STRING];
+  size_t a;
+  glob_t result;
+  struct stat st;
+  if (train_file[0] == '@') {
+    FILE *fin = fopen(train_file + 1, "rb");
+    if (fin == NULL) {
+      printf("ERROR: training data list not found!\n");
+      exit(1);
+    }
+    while (fgets(file, MAX_STRING, fin) != NULL) {
+      file[strcspn(file, "\r\n")] = 0;
+      if (file[0] != 0) AddTrainShard(file);
+    }
+    fclose(fin);
+  }
+  else if (stat(train_file, &st) == 0 && S_ISREG(st.st_mode)) AddTrainShard(train_file);
+  else {
+    if (stat(train_file, &st) == 0 && S_ISDIR(st.st_mode)) sprintf(pattern, "%s/*", train_file);
+    else strcpy(pattern, train_file);
+    if (glob(pattern, 0, NULL, &result) == 0) {
+      for (a = 0; a < result.gl_pathc; a++) AddTrainShard(result.gl_pathv[a]);
+      globfree(&result);
+    }
+  }
+  if (shard_num == 0) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  file_size = shard_offset[shard_num];
+  if (debug_mode > 0 && shard_num > 1) printf("Training data: %d files, %lldMB\n", shard_num, file_size >> 20);
+}
+
+// Records the gzip members found by a reader that read a whole shard
+void SaveGzipMembers(struct corpus_reader *cr) {
+  long long size = shard_offset[cr->shard + 1] - shard_offset[cr->shard];
+  while (cr->member_num > 0 && cr->member[cr->member_num - 1] >= size) cr->member_num--; // end of the last member
+  pthread_mutex_lock(&gzip_mutex);
+  if (gzip_member_num[cr->shard] == -1) {
+    gzip_member[cr->shard] = cr->member;
+    gzip_member_num[cr->shard] = cr->member_num;
+    cr->member = NULL;
+  }
+  pthread_mutex_unlock(&gzip_mutex);
+  free(cr->member);
+  cr->member = NULL;
+}
+
+// Decompresses the next chunk of a gzip shard; returns the number of decompressed bytes, or 0 at the end of the shard
+int InflateCorpus(struct corpus_reader *cr) {
+  int ret;
+  cr->out_pos = 0;
+  cr->out_len = 0;
+  while (cr->out_len == 0) {
+    if (cr->strm->avail_in == 0) {
+      cr->strm->avail_in = fread(cr->in, 1, CORPUS_BUFFER_SIZE, cr->fin);
+      cr->strm->next_in = cr->in;
+      if (cr->strm->avail_in == 0) {
+        if (cr->in_member) {
+          printf("ERROR: training data file %s is corrupted!\n", train_shard[cr->shard]);
+          exit(1);
+        }
+        if (cr->member != NULL) SaveGzipMembers(cr);
+        return 0;
+      }
+    }
+    cr->strm->next_out = cr->out;
+    cr->strm->avail_out = CORPUS_BUFFER_SIZE;
+    ret = inflate(cr->strm, Z_NO_FLUSH);
+    cr->out_len = CORPUS_BUFFER_SIZE - cr->strm->avail_out;
+    cr->in_member = (ret != Z_STREAM_END);
+    if (ret == Z_STREAM_END) {
+      inflateReset(cr->strm); // continue with the next gzip member
+      if (cr->member != NULL) {
+        if (cr->member_num >= cr->member_max) {
+          cr->member_max *= 2;
+          cr->member = (long long *)realloc(cr->member, cr->member_max * sizeof(long long));
+        }
+        cr->member[cr->member_num++] = ftell(cr->fin) - cr->strm->avail_in;
+      }
+    }
+    else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      printf("ERROR: training data file %s is corrupted!\n", train_shard[cr->shard]);
+      exit(1);
+    }
+  }
+  return cr->out_len;
+}
+
+// Records the blocks of a BGZF (blocked gzip) shard as its members from their headers; returns 0 if the shard is not blocked
+int IndexGzipBlocks(int shard) {
+  unsigned char header[18];
+  long long pos = 0, num = 0, max = 1000, size = shard_offset[shard + 1] - shard_offset[shard];
+  long long *block = (long long *)malloc(max * sizeof(long long));
+  FILE *fin = fopen(train_shard[shard], "rb");
+  if (fin == NULL) {
+    printf("ERROR: training data file %s not found!\n", train_shard[shard]);
+    exit(1);
+  }
+  while (pos < size) {
+    fseek(fin, pos, SEEK_SET);
+    if (fread(header, 1, 18, fin) != 18 || header[0] != 0x1f || header[1] != 0x8b || !(header[3] & 4) ||
+        header[12] != 'B' || header[13] != 'C') {
+      fclose(fin);
+      free(block);
+      return 0;
+    }
+    if (num >= max) {
+      max *= 2;
+      block = (long long *)realloc(block, max * sizeof(long long));
+    }
+    block[num++] = pos;
+    pos += header[16] + (header[17] << 8) + 1;
+  }
+  fclose(fin);
+  pthread_mutex_lock(&gzip_mutex);
+  if (gzip_member_num[shard] == -1) {
+    gzip_member[shard] = block;
+    gzip_member_num[shard] = num;
+    block = NULL;
+  }
+  pthread_mutex_unlock(&gzip_mutex);
+  free(block);
+  return 1;
+}
+void OpenCorpus(struct corpus_reader *cr, long long offset, int last_shard);
+void CloseCorpus(struct corpus_reader *cr);
+
+// Returns the first gzip member of a shard at or after offset; returns -1 if the shard is a single member
+long long FindGzipMember(int shard, long long offset) {
+  int indexed;
+  long long a, pos = shard_offset[shard + 1] - shard_offset[shard];
+  struct corpus_reader cr;
+  // The members are recorded by the first read of the whole shard or from the BGZF headers; index them here if no one did yet
+  pthread_mutex_lock(&gzip_index_mutex);
+  pthread_mutex_lock(&gzip_mutex);
+  indexed = (gzip_member_num[shard] != -1);
+  pthread_mutex_unlock(&gzip_mutex);
+  if (!indexed && !IndexGzipBlocks(shard)) {
+    OpenCorpus(&cr, shard_offset[shard], shard);
+    while (cr.member != NULL && InflateCorpus(&cr) > 0);
+    CloseCorpus(&cr);
+  }
+  pthread_mutex_unlock(&gzip_index_mutex);
+  pthread_mutex_lock(&gzip_mutex);
+  if (gzip_member_num[shard] <= 1) {
+    if (!gzip_warned) printf("WARNING: %s is a single gzip member; parallel reads need BGZF (e.g. bgzip)\n", train_shard[shard]);
+    gzip_warned = 1;
+    pos = -1;
+  }
+  else for (a = 0; a < gzip_member_num[shard]; a++) if (gzip_member[shard][a] >= offset) {
+    pos = gzip_member[shard][a];
+    break;
+  }
+  pthread_mutex_unlock(&gzip_mutex);
+  return pos;
+}
+
+// Opens the training data at the given offset of the concatenated shards
+void OpenCorpus(struct corpus_reader *cr, long long offset, int last_shard) {
+  int s = 0;
+  long long block;
+  unsigned char magic[2];
+  while (s + 1 < shard_num && shard_offset[s + 1] <= offset) s++;
+  offset -= shard_offset[s];
+  cr->fin = fopen(train_shard[s], "rb");
+  if (cr->fin == NULL) {
+    printf("ERROR: training data file %s not found!\n", train_shard[s]);
+    exit(1);
+  }
+  cr->shard = s;
+  cr->last_shard = last_shard;
+  cr->pushback = EOF;
+  cr->eof = 0;
+  cr->strm = NULL;
+  cr->member = NULL;
+  if (fread(magic, 1, 2, cr->fin) != 2 || magic[0] != 0x1f || magic[1] != 0x8b) { // plain text
+    fseek(cr->fin, offset, SEEK_SET);
+    return;
+  }
+  cr->strm = (z_stream *)calloc(1, sizeof(z_stream));
+  cr->in = (unsigned char *)malloc(CORPUS_BUFFER_SIZE);
+  cr->out = (unsigned char *)malloc(CORPUS_BUFFER_SIZE);
+  cr->out_pos = 0;
+  cr->out_len = 0;
+  cr->in_member = 0;
+  if (inflateInit2(cr->strm, 15 + 16) != Z_OK) { printf("Memory allocation failed\n"); exit(1); }
+  if (offset == 0) {
+    pthread_mutex_lock(&gzip_mutex);
+    if (gzip_member_num[s] == -1) { // index the members while reading the shard
+      cr->member_max = 1000;
+      cr->member = (long long *)malloc(cr->member_max * sizeof(long long));
+      cr->member[0] = 0;
+      cr->member_num = 1;
+    }
+    pthread_mutex_unlock(&gzip_mutex);
+    fseek(cr->fin, 0, SEEK_SET);
+    return;
+  }
+  block = FindGzipMember(s, offset);
+  if (block >= 0) {
+    fseek(cr->fin, block, SEEK_SET);
+    return;
+  }
+  // A single gzip member can only be entered at its beginning; skip the data before offset
+  fseek(cr->fin, 0, SEEK_SET);
+  while (ftell(cr->fin) - cr->strm->avail_in < offset && InflateCorpus(cr) > 0);
+  cr->out_pos = cr->out_len;
+}
+
+void CloseCorpus(struct corpus_reader *cr) {
+  fclose(cr->fin);
+  free(cr->member);
+  if (cr->strm != NULL) {
+    inflateEnd(cr->strm);
+    free(cr->strm);
+    free(cr->in);
+    free(cr->out);
+  }
+}
+
+// Reads a character from the training data; the end of a shard is read as a line break
+int CorpusGetc(struct corpus_reader *cr) {
+  int ch = cr->pushback;
+  if (ch != EOF) {
+    cr->pushback = EOF;
+    return ch;
+  }
+  if (cr->strm == NULL) ch = fgetc(cr->fin);
+  else if (cr->out_pos < cr->out_len || InflateCorpus(cr) > 0) ch = cr->out[cr->out_pos++];
+  else ch = EOF;
+  if (ch == EOF) {
+    if (cr->shard < cr->last_shard) {
+      CloseCorpus(cr);
+      OpenCorpus(cr, shard_offset[cr->shard + 1], cr->last_shard);
+      return '\n';
+    }
+    cr->eof = 1;
+  }
+  return ch;
+}
+
+void CorpusUngetc(int ch, struct corpus_reader *cr) {
+  cr->pushback = ch;
+}
+
+// Reads a single word from the training data, assuming space + tab + EOL to be word boundaries
+void ReadCorpusWord(char *word, struct corpus_reader *cr) {
+  int a = 0, ch;
+  while (!cr->eof) {
+    ch = CorpusGetc(cr);
+    if ( ch <= ' ' || ch == 127 ) {
+      if (a > 0) {
+        if (ch == '\n') CorpusUngetc(ch, cr);
+        break;
+      }
+      if (ch == '\n') {
+        strcpy(word, (char *)"</s>");
+        return;
+      }
+      else continue;
+    }
+    word[a] = ch;
+    a++;
+    if (a >= MAX_STRING - 1) a--;   // Truncate too long words
+  }
+  word[a] = 0;
+}
+
 // Returns hash value of a word
 int GetWordHash(char *word) {
   unsigned long long a, hash = 0;
@@ -163,9 +705,8 @@ int GetWordHash(char *word) {
   return hash;
 }
 
-// Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
+// Returns position of a word with known hash value in the vocabulary; if the word is not found, returns -1
+int SearchVocabWithHash(char *word, unsigned int hash) {
   while (1) {
     if (vocab_hash[hash] == -1) return -1;
     if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
@@ -174,21 +715,26 @@ int SearchVocab(char *word) {
   return -1;
 }
 
+// Returns position of a word in the vocabulary; if the word is not found, returns -1
+int SearchVocab(char *word) {
+  return SearchVocabWithHash(word, GetWordHash(word));
+}
+
 // Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin) {
+int ReadWordIndex(struct corpus_reader *cr) {
   char word[MAX_STRING];
-  ReadWord(word, fin);
-  if (feof(fin)) return -1;
+  ReadCorpusWord(word, cr);
+  if (cr->eof) return -1;
   return SearchVocab(word);
 }
 
 // Reads a pair and returns their index in the vocabulary
-void *ReadItemIndex(FILE *fin, long long *IndexOfPair) {
+void *ReadItemIndex(struct corpus_reader *cr, long long *IndexOfPair) {
   char item[MAX_STRING];
   char pair[2][MAX_STRING]; // 0 is word, 1 is feature
-  ReadWord(item, fin);
+  ReadCorpusWord(item, cr);
 
-  if (feof(fin)) {
+  if (cr->eof) {
     IndexOfPair[0] = -1;
     return IndexOfPair;
   }
@@ -217,6 +763,8 @@ int AddWordToVocab(char *word) {
   vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
   strcpy(vocab[vocab_size].word, word);
   vocab[vocab_size].cn = 0;
+  vocab[vocab_size].List = NULL;
+  vocab[vocab_size].isFeature = 0;
   vocab_size++;
   // Reallocate memory if needed
   if (vocab_size + 2 >= vocab_max_size) {
@@ -234,9 +782,12 @@ int VocabCompare(const void *a, const void *b) {
   return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
 }
 
-// for sorting by type
+// for sorting by type, keeping each type sorted by word counts
 int FeatureCompare(const void *a, const void *b) {
-  return ((((struct vocab_word *)a)->isFeature - ((struct vocab_word *)b)->isFeature));
+  struct vocab_word *va = (struct vocab_word *)a, *vb = (struct vocab_word *)b;
+  if (va->isFeature != vb->isFeature) return va->isFeature < vb->isFeature ? -1 : 1;
+  if (va->cn != vb->cn) return va->cn > vb->cn ? -1 : 1;
+  return 0;
 }
 
 // Sorts the vocabulary by frequency using word counts
@@ -275,8 +826,7 @@ void ReduceVocab() {
   int a, b = 0;
   unsigned int hash;
   for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
-    vocab[b].cn = vocab[a].cn;
-    vocab[b].word = vocab[a].word;
+    vocab[b] = vocab[a];
     b++;
   }
   else free(vocab[a].word);
@@ -292,138 +842,378 @@ void ReduceVocab() {
   min_reduce++;
 }
 
-void LearnVocabFromTrainFile() {
+// Reads a knowledge file in text format; each row contains a feature and the corresponding words
+void ReadKnowledgeText(struct knowledge_table *kt, FILE *fin) {
   char word[MAX_STRING];
-  char feature[MAX_STRING];
-  char temp[MAX_STRING];
-  FILE *fin;
-  FILE *fin2;
-  long long a, i;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
-    exit(1);
-  }
-  vocab_size = 0;
-  AddWordToVocab((char *)"</s>");
+  long long feature_max = 1000, edge_max = 1000, pool_max = 1 << 20, length;
+  int idx = 0;
+  kt->feature_num = 0;
+  kt->edge_num = 0;
+  kt->pool_size = 0;
+  kt->feature = (long long *)malloc(feature_max * sizeof(long long));
+  kt->edge_begin = (long long *)malloc((feature_max + 1) * sizeof(long long));
+  kt->edge = (struct knowledge_edge *)malloc(edge_max * sizeof(struct knowledge_edge));
+  kt->pool = (char *)malloc(pool_max);
+  kt->compiled = 0;
   while (1) {
     ReadWord(word, fin);
     if (feof(fin)) break;
-    if (feature_mode == 1) {
-      if (strcmp(word, "</s>") != 0) {
-        int delimiter_index = lstrchar(word, '('); //format apple(NN) banana(NN)
-        if (delimiter_index == -1 || delimiter_index + 1 == strlen(word) - 1 || word[strlen(word) - 1] != ')') exit(0);
-        substrncpy(temp, word, 0, delimiter_index);
-        substrncpy(feature, word, delimiter_index + 1, strlen(word) - 1);
-        strcpy(word, temp);
-        i = SearchVocab(feature);
-        if (i == -1) {
-          a = AddWordToVocab(feature);
-          vocab[a].cn = 1;
-          vocab[a].List = NULL;
-          vocab[a].isFeature = 1;
-        }
-        else vocab[i].cn++;
-      }
+    if (!strcmp(word, "</s>")) {
+      idx = 0; //reset
+      continue;
+    }
+    // Reallocate memory if needed
+    length = strlen(word) + 1;
+    if (kt->pool_size + length > pool_max) {
+      pool_max *= 2;
+      kt->pool = (char *)realloc(kt->pool, pool_max);
+    }
+    if (kt->feature_num >= feature_max) {
+      feature_max *= 2;
+      kt->feature = (long long *)realloc(kt->feature, feature_max * sizeof(long long));
+      kt->edge_begin = (long long *)realloc(kt->edge_begin, (feature_max + 1) * sizeof(long long));
+    }
+    if (kt->edge_num >= edge_max) {
+      edge_max *= 2;
+      kt->edge = (struct knowledge_edge *)realloc(kt->edge, edge_max * sizeof(struct knowledge_edge));
     }
-    train_words++;
-    if ((debug_mode > 1) && (train_words % 100000 == 0)) {
-      printf("%lldK\r", train_words / 1000);
-      fflush(stdout);
+    strcpy(kt->pool + kt->pool_size, word);
+    if (idx == 0) { //is Feature
+      kt->feature[kt->feature_num] = kt->pool_size;
+      kt->edge_begin[kt->feature_num] = kt->edge_num;
+      kt->feature_num++;
     }
-    i = SearchVocab(word);
+    else { //is word
+      kt->edge[kt->edge_num].word = kt->pool_size;
+      kt->edge[kt->edge_num].hash = GetWordHash(word);
+      kt->edge_num++;
+    }
+    kt->pool_size += length;
+    idx++;
+  }
+  kt->edge_begin[kt->feature_num] = kt->edge_num;
+}
+
+// Reads a knowledge file, either compiled by -compile-knfile (memory mapped) or in text format
+void ReadKnowledge(struct knowledge_table *kt, char *file) {
+  struct knowledge_header header;
+  long long size;
+  char *base;
+  FILE *fin = fopen(file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: KnowledgeFile %s not found!\n", file);
+    exit(1);
+  }
+  if (fread(&header, sizeof(struct knowledge_header), 1, fin) != 1 ||
+      memcmp(header.magic, KNOWLEDGE_MAGIC, sizeof(header.magic))) {
+    fseek(fin, 0, SEEK_SET);
+    ReadKnowledgeText(kt, fin);
+    fclose(fin);
+    return;
+  }
+  fseek(fin, 0, SEEK_END);
+  size = ftell(fin);
+  if (size != sizeof(struct knowledge_header) + (2 * header.feature_num + 1) * sizeof(long long) +
+              header.edge_num * sizeof(struct knowledge_edge) + header.pool_size) {
+    printf("ERROR: KnowledgeFile %s is corrupted!\n", file);
+    exit(1);
+  }
+  if (header.hash_size != vocab_hash_size) {
+    printf("ERROR: KnowledgeFile %s was compiled with a different hash size!\n", file);
+    exit(1);
+  }
+  base = (char *)MapFile(fin, size);
+  fclose(fin);
+  kt->feature_num = header.feature_num;
+  kt->edge_num = header.edge_num;
+  kt->pool_size = header.pool_size;
+  kt->feature = (long long *)(base + sizeof(struct knowledge_header));
+  kt->edge_begin = kt->feature + kt->feature_num;
+  kt->edge = (struct knowledge_edge *)(kt->edge_begin + kt->feature_num + 1);
+  kt->pool = (char *)(kt->edge + kt->edge_num);
+  kt->compiled = 1;
+}
+
+// Compiles the knowledge file into a binary sense table
+void CompileKnowledge() {
+  struct knowledge_table kt;
+  struct knowledge_header header;
+  FILE *fo;
+  if (NumberOfKnowledgeFile != 1) {
+    printf("ERROR: -compile-knfile requires exactly one knowledge file!\n");
+    exit(1);
+  }
+  ReadKnowledge(&kt, knowledge_file[0]);
+  memset(&header, 0, sizeof(struct knowledge_header));
+  memcpy(header.magic, KNOWLEDGE_MAGIC, sizeof(header.magic));
+  header.feature_num = kt.feature_num;
+  header.edge_num = kt.edge_num;
+  header.pool_size = kt.pool_size;
+  header.hash_size = vocab_hash_size;
+  fo = fopen(compile_knowledge_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot open %s!\n", compile_knowledge_file);
+    exit(1);
+  }
+  fwrite(&header, sizeof(struct knowledge_header), 1, fo);
+  fwrite(kt.feature, sizeof(long long), kt.feature_num, fo);
+  fwrite(kt.edge_begin, sizeof(long long), kt.feature_num + 1, fo);
+  fwrite(kt.edge, sizeof(struct knowledge_edge), kt.edge_num, fo);
+  fwrite(kt.pool, 1, kt.pool_size, fo);
+  fclose(fo);
+  if (debug_mode > 0) printf("Compiled %lld features and %lld words into %s\n", kt.feature_num, kt.edge_num, compile_knowledge_file);
+}
+
+// Creates the features of a knowledge file in the vocabulary, counting the words linked to each feature
+void CreateKnowledgeFeature(struct knowledge_table *kt, int head) {
+  long long a, e, i, cn;
+  int WordNum;
+  for (a = 0; a < kt->feature_num; a++) {
+    cn = 0;
+    WordNum = 0;
+    for (e = kt->edge_begin[a]; e < kt->edge_begin[a + 1]; e++) {
+      i = SearchVocabWithHash(kt->pool + kt->edge[e].word, kt->edge[e].hash);
+      if (i > 0 && !vocab[i].isFeature && vocab[i].cn >= min_count) {
+        cn += vocab[i].cn;
+        WordNum++;
+      }
+    }
+    if (WordNum < 2) continue;
+    i = SearchVocab(kt->pool + kt->feature[a]);
     if (i == -1) {
-      a = AddWordToVocab(word);
-      vocab[a].cn = 1;
-      vocab[a].List = NULL;
-      vocab[a].isFeature = 0;
+      i = AddWordToVocab(kt->pool + kt->feature[a]);
+      vocab[i].isFeature = head;
     }
-    else vocab[i].cn++;
+    else if (vocab[i].isFeature != head) continue; // skip names owned by a word or another head
+    vocab[i].cn += cn;
     if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
   }
-  printf("\n");
+}
 
-  if (feature_mode == 2) {
-    fin2 = fopen(knowledge_file, "rb");
-    if (fin2 == NULL) {
-      printf("ERROR: KnowledgeFile not found!\n");
-      exit(1);
-    }
-    int idx = 0;
-    int WordNum = 0;
-    long long TempFeatureID = 0;
-    while (1) { //Create Feature in Dict
-      ReadWord(word, fin2);
-      if (feof(fin2)) break;
-      i = SearchVocab(word);
-      if (i == -1) {
-        if (idx == 0) { //is Feature
-          a = AddWordToVocab(word);
-          vocab[a].cn = 0;
-          vocab[a].List = NULL;
-          vocab[a].isFeature = 1;
-          TempFeatureID = a;
+// Links the words of a knowledge file to their features; the vocabulary must be sorted
+void LinkKnowledgeFeature(struct knowledge_table *kt, int head) {
+  long long a, e, i, FeatureID;
+  for (a = 0; a < kt->feature_num; a++) {
+    FeatureID = SearchVocab(kt->pool + kt->feature[a]);
+    if (FeatureID == -1 || vocab[FeatureID].isFeature != head) continue;
+    for (e = kt->edge_begin[a]; e < kt->edge_begin[a + 1]; e++) {
+      i = SearchVocabWithHash(kt->pool + kt->edge[e].word, kt->edge[e].hash);
+      if (i > 0 && !vocab[i].isFeature && vocab[i].cn >= min_count) {
+        struct Node* FeatureNode = (struct Node *)malloc(sizeof(struct Node));
+        FeatureNode->item = FeatureID;
+        FeatureNode->next = NULL;
+
+        struct Node* temp = vocab[i].List;
+        if (!temp)
+          vocab[i].List = FeatureNode;
+        else {
+          while (1) {
+            if (temp->next == NULL) {
+              temp->next = FeatureNode;
+              break;
+            }
+            temp = temp->next;
+          }
         }
-        idx++;
       }
-      else {
-        if (i != 0) { //is word
-          if (vocab[i].cn >= min_count) {
-            vocab[TempFeatureID].cn += vocab[i].cn;
-            WordNum++;
+    }
+  }
+}
+
+// Returns position of a word in the vocabulary of a learner; if the word is not found, returns -1
+long long SearchLearnerVocab(struct vocab_learner *lv, char *word) {
+  unsigned int hash = GetWordHash(word) % lv->hash_size;
+  while (1) {
+    if (lv->hash[hash] == -1) return -1;
+    if (!strcmp(word, lv->vocab[lv->hash[hash]].word)) return lv->hash[hash];
+    hash = (hash + 1) % lv->hash_size;
+  }
+  return -1;
+}
+
+// Adds a word to the vocabulary of a learner
+long long AddWordToLearnerVocab(struct vocab_learner *lv, char *word) {
+  unsigned int hash, length = strlen(word) + 1;
+  if (length > MAX_STRING) length = MAX_STRING;
+  lv->vocab[lv->size].word = (char *)calloc(length, sizeof(char));
+  strcpy(lv->vocab[lv->size].word, word);
+  lv->vocab[lv->size].cn = 0;
+  lv->vocab[lv->size].List = NULL;
+  lv->vocab[lv->size].isFeature = 0;
+  lv->size++;
+  // Reallocate memory if needed
+  if (lv->size + 2 >= lv->max_size) {
+    lv->max_size += 1000;
+    lv->vocab = (struct vocab_word *)realloc(lv->vocab, lv->max_size * sizeof(struct vocab_word));
+  }
+  hash = GetWordHash(word) % lv->hash_size;
+  while (lv->hash[hash] != -1) hash = (hash + 1) % lv->hash_size;
+  lv->hash[hash] = lv->size - 1;
+  return lv->size - 1;
+}
+
+// Grows the hash table of a learner up to vocab_hash_size; once it cannot grow, either because of its size or
+// because the learners together hold 2 * vocab_hash_size slots, removes infrequent tokens instead
+void ReduceLearnerVocab(struct vocab_learner *lv) {
+  long long a, b = 0, hash_size = lv->hash_size * 2;
+  unsigned int hash;
+  int grow = 0;
+  if (hash_size > vocab_hash_size) hash_size = vocab_hash_size;
+  pthread_mutex_lock(&learner_mutex);
+  if (hash_size > lv->hash_size && learner_hash_slots + hash_size - lv->hash_size <= 2LL * vocab_hash_size) {
+    learner_hash_slots += hash_size - lv->hash_size;
+    grow = 1;
+  }
+  pthread_mutex_unlock(&learner_mutex);
+  if (grow) {
+    lv->hash_size = hash_size;
+    lv->hash = (int *)realloc(lv->hash, lv->hash_size * sizeof(int));
+  }
+  else {
+    for (a = 0; a < lv->size; a++) if (lv->vocab[a].cn > lv->min_reduce) {
+      lv->vocab[b] = lv->vocab[a];
+      b++;
+    }
+    else free(lv->vocab[a].word);
+    lv->size = b;
+    lv->min_reduce++;
+  }
+  for (a = 0; a < lv->hash_size; a++) lv->hash[a] = -1;
+  for (a = 0; a < lv->size; a++) {
+    // Hash will be re-computed, as it is not actual
+    hash = GetWordHash(lv->vocab[a].word) % lv->hash_size;
+    while (lv->hash[hash] != -1) hash = (hash + 1) % lv->hash_size;
+    lv->hash[hash] = a;
+  }
+}
+
+// Learns the vocabulary of the shards assigned to a learner
+void *LearnVocabThread(void *arg) {
+  struct vocab_learner *lv = (struct vocab_learner *)arg;
+  char word[MAX_STRING];
+  char feature[MAX_STRING];
+  char temp[MAX_STRING];
+  struct corpus_reader cr;
+  long long a, i, words = 0;
+  int s;
+  lv->max_size = 1000;
+  lv->vocab = (struct vocab_word *)calloc(lv->max_size, sizeof(struct vocab_word));
+  lv->hash_size = 1 << 20;
+  pthread_mutex_lock(&learner_mutex);
+  learner_hash_slots += lv->hash_size;
+  pthread_mutex_unlock(&learner_mutex);
+  lv->hash = (int *)malloc(lv->hash_size * sizeof(int));
+  for (a = 0; a < lv->hash_size; a++) lv->hash[a] = -1;
+  lv->min_reduce = 1;
+  for (s = 0; s < lv->shard_num; s++) {
+    OpenCorpus(&cr, shard_offset[lv->shard[s]], lv->shard[s]);
+    while (1) {
+      ReadCorpusWord(word, &cr);
+      if (cr.eof) break;
+      if (feature_mode & 1) {
+        if (strcmp(word, "</s>") != 0) {
+          int delimiter_index = lstrchar(word, '('); //format apple(NN) banana(NN)
+          if (delimiter_index == -1 || delimiter_index + 1 == strlen(word) - 1 || word[strlen(word) - 1] != ')') exit(0);
+          substrncpy(temp, word, 0, delimiter_index);
+          substrncpy(feature, word, delimiter_index + 1, strlen(word) - 1);
+          strcpy(word, temp);
+          i = SearchLearnerVocab(lv, feature);
+          if (i == -1) {
+            a = AddWordToLearnerVocab(lv, feature);
+            lv->vocab[a].cn = 1;
+            lv->vocab[a].isFeature = 1;
           }
-          idx++;
-        }
-        else {  // is </s>
-          if (WordNum < 2) vocab[TempFeatureID].cn = 0;
-          idx = 0; //reset
-          WordNum = 0;
+          else lv->vocab[i].cn++;
         }
       }
+      words++;
+      if ((debug_mode > 1) && (words % 100000 == 0)) {
+        pthread_mutex_lock(&learner_mutex);
+        train_words += 100000;
+        printf("%lldK\r", train_words / 1000);
+        fflush(stdout);
+        pthread_mutex_unlock(&learner_mutex);
+      }
+      i = SearchLearnerVocab(lv, word);
+      if (i == -1) {
+        a = AddWordToLearnerVocab(lv, word);
+        lv->vocab[a].cn = 1;
+      }
+      else lv->vocab[i].cn++;
+      if (lv->size > lv->hash_size * 0.7) ReduceLearnerVocab(lv);
+    }
+    CloseCorpus(&cr);
+  }
+  free(lv->hash);
+  pthread_mutex_lock(&learner_mutex);
+  learner_hash_slots -= lv->hash_size;
+  pthread_mutex_unlock(&learner_mutex);
+  pthread_exit(NULL);
+  return NULL;
+}
+
+// Used for distributing the shards to the learners, largest first
+int ShardCompare(const void *a, const void *b) {
+  long long size_a = shard_offset[*(int *)a + 1] - shard_offset[*(int *)a];
+  long long size_b = shard_offset[*(int *)b + 1] - shard_offset[*(int *)b];
+  return (size_a < size_b) - (size_a > size_b);
+}
+
+void LearnVocabFromTrainFile() {
+  long long a, b, i;
+  int s, w, learner_num = (num_threads < shard_num) ? num_threads : shard_num;
+  int *order = (int *)malloc(shard_num * sizeof(int));
+  struct vocab_learner *learner = (struct vocab_learner *)calloc(learner_num, sizeof(struct vocab_learner));
+  pthread_t *pt = (pthread_t *)malloc(learner_num * sizeof(pthread_t));
+  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  // Distribute the shards to the learners balanced by size
+  for (s = 0; s < shard_num; s++) order[s] = s;
+  qsort(order, shard_num, sizeof(int), ShardCompare);
+  for (w = 0; w < learner_num; w++) learner[w].shard = (int *)malloc(shard_num * sizeof(int));
+  for (s = 0; s < shard_num; s++) {
+    int lightest = 0;
+    for (w = 1; w < learner_num; w++) if (learner[w].bytes < learner[lightest].bytes) lightest = w;
+    learner[lightest].shard[learner[lightest].shard_num++] = order[s];
+    learner[lightest].bytes += shard_offset[order[s] + 1] - shard_offset[order[s]];
+  }
+  for (w = 0; w < learner_num; w++) pthread_create(&pt[w], NULL, LearnVocabThread, (void *)&learner[w]);
+  for (w = 0; w < learner_num; w++) pthread_join(pt[w], NULL);
+  // Merge the vocabularies of the learners
+  vocab_size = 0;
+  AddWordToVocab((char *)"</s>");
+  for (w = 0; w < learner_num; w++) {
+    for (b = 0; b < learner[w].size; b++) {
+      i = SearchVocab(learner[w].vocab[b].word);
+      if (i == -1) {
+        a = AddWordToVocab(learner[w].vocab[b].word);
+        vocab[a].cn = learner[w].vocab[b].cn;
+        vocab[a].isFeature = learner[w].vocab[b].isFeature;
+      }
+      else vocab[i].cn += learner[w].vocab[b].cn;
+      free(learner[w].vocab[b].word);
       if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
     }
+    free(learner[w].vocab);
+    free(learner[w].shard);
+  }
+  free(learner);
+  free(order);
+  free(pt);
+  printf("\n");
+
+  if (feature_mode & 2) {
+    int k;
+    struct knowledge_table kt[MAX_HEAD];
+    for (k = 0; k < NumberOfKnowledgeFile; k++) { //Create Feature in Dict
+      ReadKnowledge(&kt[k], knowledge_file[k]);
+      if (debug_mode > 0) printf("Knowledge file %s: %lld features, %lld words (%s)\n", knowledge_file[k],
+                                 kt[k].feature_num, kt[k].edge_num, kt[k].compiled ? "compiled" : "text");
+      CreateKnowledgeFeature(&kt[k], KnowledgeHead(k));
+    }
     SortVocab(); //Remove less Feature
-    fseek(fin2, 0, SEEK_SET);
-    idx = 0;
-    long long FeatureID = 0;
-    while (1) { //Establish Word Link to Feature
-      ReadWord(word, fin2);
-      if (feof(fin2)) break;
-      i = SearchVocab(word);
-      if (i != -1) {
-        if (idx == 0) { //is Feature
-          if (i != 0) {
-            FeatureID = i;
-          }
-        }
-        else {
-          if (vocab[i].cn >= min_count && i != 0) {
-            struct Node* FeatureNode = (struct Node *)malloc(sizeof(struct Node));
-            FeatureNode->item = FeatureID;
-            FeatureNode->next = NULL;
-
-            struct Node* temp = vocab[i].List;
-            if (!temp)
-              vocab[i].List = FeatureNode;
-            else {
-              while (1) {
-                if (temp->next == NULL) {
-                  temp->next = FeatureNode;
-                  break;
-                }
-                temp = temp->next;
-              }
-            }
-          }
-        }
-        if (i == 0) {  // is </s>
-          idx = 0; //reset
-        }
-        else idx++;
-      }
+    for (k = 0; k < NumberOfKnowledgeFile; k++) { //Establish Word Link to Feature
+      LinkKnowledgeFeature(&kt[k], KnowledgeHead(k));
     }
-    fclose(fin2);
   }
   else {
     SortVocab();
@@ -436,92 +1226,318 @@ void LearnVocabFromTrainFile() {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  file_size = ftell(fin);
-  fclose(fin);
+}
+
+// Saves the vocabulary as a binary snapshot, including the feature links and the hash table
+void SaveVocabSnapshot(FILE *fo) {
+  long long i;
+  struct Node *temp;
+  struct vocab_header header;
+  struct vocab_entry entry;
+  memset(&header, 0, sizeof(struct vocab_header));
+  memcpy(header.magic, VOCAB_MAGIC, sizeof(header.magic));
+  header.vocab_size = vocab_size;
+  header.train_words = train_words;
+  header.feature_mode = feature_mode;
+  header.feature_num = NumberOfFeature;
+  header.head_num = NumberOfHead;
+  header.hash_size = vocab_hash_size;
+  fwrite(&header, sizeof(struct vocab_header), 1, fo);
+  memset(&entry, 0, sizeof(struct vocab_entry));
+  for (i = 0; i < vocab_size; i++) {
+    entry.cn = vocab[i].cn;
+    entry.word = header.pool_size;
+    entry.link_begin = header.link_num;
+    entry.link_num = 0;
+    for (temp = vocab[i].List; temp != NULL; temp = temp->next) entry.link_num++;
+    entry.isFeature = vocab[i].isFeature;
+    fwrite(&entry, sizeof(struct vocab_entry), 1, fo);
+    header.pool_size += strlen(vocab[i].word) + 1;
+    header.link_num += entry.link_num;
+  }
+  for (i = 0; i < vocab_size; i++) {
+    for (temp = vocab[i].List; temp != NULL; temp = temp->next) fwrite(&temp->item, sizeof(long long), 1, fo);
+  }
+  fwrite(vocab_hash, sizeof(int), vocab_hash_size, fo);
+  for (i = 0; i < vocab_size; i++) fwrite(vocab[i].word, 1, strlen(vocab[i].word) + 1, fo);
+  fseek(fo, 0, SEEK_SET);
+  fwrite(&header, sizeof(struct vocab_header), 1, fo);
 }
 
 void SaveVocab() {
   long long i;
   FILE *fo = fopen(save_vocab_file, "wb");
-  for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", vocab[i].word, vocab[i].cn);
+  if (binary_vocab) SaveVocabSnapshot(fo);
+  else for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", vocab[i].word, vocab[i].cn);
   fclose(fo);
 }
 
+// Reads a binary vocabulary snapshot; the hash table and the strings are memory mapped
+void ReadVocabSnapshot(FILE *fin, struct vocab_header *header) {
+  long long a, size = GetFileSize(read_vocab_file);
+  char *base;
+  struct vocab_entry *entry;
+  long long *link;
+  struct Node *node;
+  if (size != sizeof(struct vocab_header) + header->vocab_size * sizeof(struct vocab_entry) +
+              header->link_num * sizeof(long long) + (long long)header->hash_size * sizeof(int) + header->pool_size) {
+    printf("ERROR: vocabulary snapshot is corrupted!\n");
+    exit(1);
+  }
+  if (header->hash_size != vocab_hash_size) {
+    printf("ERROR: vocabulary snapshot was saved with a different hash size!\n");
+    exit(1);
+  }
+  if (header->feature_mode != feature_mode) {
+    printf("ERROR: vocabulary snapshot was saved with -fmode %d!\n", header->feature_mode);
+    exit(1);
+  }
+  base = (char *)MapFile(fin, size);
+  entry = (struct vocab_entry *)(base + sizeof(struct vocab_header));
+  link = (long long *)(entry + header->vocab_size);
+  free(vocab_hash);
+  vocab_hash = (int *)(link + header->link_num);
+  vocab_size = header->vocab_size;
+  vocab_max_size = vocab_size + 1;
+  vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  node = (struct Node *)malloc((header->link_num + 1) * sizeof(struct Node));
+  for (a = 0; a < header->link_num; a++) {
+    node[a].item = link[a];
+    node[a].next = &node[a + 1];
+  }
+  for (a = 0; a < vocab_size; a++) {
+    vocab[a].cn = entry[a].cn;
+    vocab[a].word = (char *)(vocab_hash + header->hash_size) + entry[a].word;
+    vocab[a].isFeature = entry[a].isFeature;
+    vocab[a].List = NULL;
+    if (entry[a].link_num > 0) {
+      vocab[a].List = &node[entry[a].link_begin];
+      node[entry[a].link_begin + entry[a].link_num - 1].next = NULL;
+    }
+  }
+  train_words = header->train_words;
+  NumberOfFeature = header->feature_num;
+  NumberOfHead = header->head_num;
+  _NULL = SearchVocab("NULL");
+}
+
 void ReadVocab() {
   long long a, i = 0;
   char c;
   char word[MAX_STRING];
+  struct vocab_header header;
   FILE *fin = fopen(read_vocab_file, "rb");
   if (fin == NULL) {
     printf("Vocabulary file not found\n");
     exit(1);
   }
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  vocab_size = 0;
-  while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    a = AddWordToVocab(word);
-    fscanf(fin, "%lld%c", &vocab[a].cn, &c);
-    i++;
+  if (fread(&header, sizeof(struct vocab_header), 1, fin) == 1 && !memcmp(header.magic, VOCAB_MAGIC, sizeof(header.magic))) {
+    ReadVocabSnapshot(fin, &header);
+  }
+  else {
+    // Only a snapshot holds the knowledge links; a text vocabulary needs -knfile for them
+    if ((feature_mode & 2) && NumberOfKnowledgeFile == 0) {
+      printf("ERROR: KnowledgeFile not found!\n");
+      exit(1);
+    }
+    fseek(fin, 0, SEEK_SET);
+    for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+    vocab_size = 0;
+    while (1) {
+      ReadWord(word, fin);
+      if (feof(fin)) break;
+      a = AddWordToVocab(word);
+      fscanf(fin, "%lld%c", &vocab[a].cn, &c);
+      i++;
+    }
+    SortVocab();
   }
-  SortVocab();
+  fclose(fin);
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
-    exit(1);
-  }
-  fseek(fin, 0, SEEK_END);
-  file_size = ftell(fin);
-  fclose(fin);
-}
-
-#ifdef WIN32
-int posix_memalign(void **memptr,
-  size_t alignment,
-  size_t size) {
-  *memptr = _aligned_malloc(size, alignment);
-  if (errno != 0)
-    return errno;
-  else
-    return 0;
 }
-#endif
 
-void InitNet() {
-  long long a, b;
+void InitNet(struct model *m) {
+  long long a, b, layer1_size = m->layer1_size;
   unsigned long long next_random = 1;
-  a = posix_memalign((void **)&syn0, 128, (long long)vocab_size * layer1_size * sizeof(real));
-  if (syn0 == NULL) { printf("Memory allocation failed\n"); exit(1); }
-  if (negative>0) {
-    a = posix_memalign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(real));
-    if (syn1neg == NULL) { printf("Memory allocation failed\n"); exit(1); }
-    for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
-      syn1neg[a * layer1_size + b] = 0;
-  }
+  m->syn0 = AllocateMatrix(vocab_size, layer1_size, "syn0");
+  if (m->negative>0) m->syn1neg = AllocateMatrix(vocab_size, layer1_size, "syn1neg");
   //initial word vector
   for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++) {
     next_random = next_random * (unsigned long long)25214903917 + 11;
-    syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+    m->syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
   }
 }
 
+// Trains a model on the word at a position of a sentence, with the learning rate the model has at the time
+void TrainWord(struct model *m, long long *sen, long long *sen_pos, long long sentence_length,
+               long long sentence_position, unsigned long long *random, real *neu1e) {
+  long long a, b, d, word, last_word, feature = 0;
+  long long l1, l2, c, target, label, layer1_size = m->layer1_size;
+  int window = m->window, negative = m->negative;
+  unsigned long long next_random = *random;
+  real f, g, alpha = m->alpha, *syn0 = m->syn0, *syn1neg = m->syn1neg;
+
+  word = sen[sentence_position];
+
+  if (word == -1) return;
+  if (feature_mode & 1) feature = sen_pos[sentence_position]; //feature
+
+  for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+
+  next_random = next_random * (unsigned long long)25214903917 + 11;
+  b = next_random % window;
+
+  //train skip-gram
+  for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+    c = sentence_position - window + a;
+    if (c < 0) continue;
+    if (c >= sentence_length) continue;
+    last_word = sen[c];
+    if (last_word == -1) continue;
+    l1 = last_word * layer1_size;
+    for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+    // NEGATIVE SAMPLING
+    if (negative > 0) {
+      for (d = 0; d < negative + 1; d++) {
+        if (d == 0) {
+          target = word;
+          label = 1;
+        }
+        else {
+          next_random = next_random * (unsigned long long)25214903917 + 11;
+          target = table[(next_random >> 16) % table_size];
+          if (target == 0) target = next_random % (vocab_size - 1 - NumberOfFeature) + 1;
+          if (target == word) continue;
+          label = 0;
+        }
+        l2 = target * layer1_size;
+        f = 0;
+        for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
+        if (f >= MAX_EXP) g = (label - 1) * alpha;
+        else if (f <= -MAX_EXP) g = (label - 0) * alpha;
+        else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+        for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
+        for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
+      }
+      // Learn weights input from hidden
+      for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
+    }
+  }
+
+  if (m->feature_mode & 1) {
+
+    if (feature != _NULL) {
+
+      l1 = word * layer1_size;
+      for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+
+      //center word predict self-feature
+      for (d = 0; d < negative + 1; d++) {
+        if (d == 0) {
+          target = feature;
+          label = 1;
+        }
+        else {
+          next_random = next_random * (unsigned long long)25214903917 + 11;
+          target = Ftable[1][(next_random >> 16) % table_size]; // sequential feature tags are always head 1
+          if (target == feature) continue;
+          label = 0;
+        }
+        l2 = target * layer1_size;
+        f = 0;
+        for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
+        if (f >= MAX_EXP) g = (label - 1) * alpha;
+        else if (f <= -MAX_EXP) g = (label - 0) * alpha;
+        else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+        for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
+        for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
+      }
+
+      // Learn weights input from hidden
+      for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
+
+    }
+  }
+  if (m->feature_mode & 2) {
+
+    l1 = word * layer1_size;
+    for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+
+    struct Node *temp;
+    //center word predict self-feature
+    temp = vocab[word].List;
+    while (temp != NULL) {
+      long long feature = temp->item;
+      for (d = 0; d < negative + 1; d++) {
+        if (d == 0) {
+          target = feature;
+          label = 1;
+        }
+        else {
+          next_random = next_random * (unsigned long long)25214903917 + 11;
+          target = Ftable[vocab[feature].isFeature][(next_random >> 16) % table_size];
+          if (target == feature) continue;
+          label = 0;
+        }
+        l2 = target * layer1_size;
+        f = 0;
+        for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
+        if (f > MAX_EXP) g = (label - 1) * alpha;
+        else if (f < -MAX_EXP) g = (label - 0) * alpha;
+        else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+        for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
+        for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
+      }
+      temp = temp->next;
+    }
+
+    // Learn weights input from hidden
+    for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
+
+  }
+  *random = next_random;
+}
+
+// Trains a model on a sentence of word ids (and sequential feature ids), subsampled with the model's threshold
+void TrainSentence(struct model *m, long long *words, long long *features, long long length,
+                   unsigned long long *random, real *neu1e) {
+  long long a, word, sentence_length = 0, sentence_position;
+  long long sen[MAX_SENTENCE_LENGTH + 1], sen_pos[MAX_SENTENCE_LENGTH + 1];
+  unsigned long long next_random = *random;
+  real sample = m->sample;
+
+  for (a = 0; a < length; a++) {
+    word = words[a];
+    // The subsampling randomly discards frequent words while keeping the ranking same
+    if (sample > 0) {
+      real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      if (ran < (next_random & 0xFFFF) / (real)65536) continue;
+    }
+    sen[sentence_length] = word;
+    if (feature_mode & 1) sen_pos[sentence_length] = features[a]; //feature
+    sentence_length++;
+  }
+  *random = next_random;
+
+  for (sentence_position = 0; sentence_position < sentence_length; sentence_position++)
+    TrainWord(m, sen, sen_pos, sentence_length, sentence_position, random, neu1e);
+}
+
 void *TrainModelThread(void *id) {
-  long long a, b, d, word, last_word, sentence_length = 0, sentence_position = 0, feature = 0, *IndexOfPair;
+  long long word, sentence_length = 0, sentence_position = 0, feature = 0, *IndexOfPair;
   long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1], sen_pos[MAX_SENTENCE_LENGTH + 1];
-  long long l1, l2, c, target, label, local_iter = iter;
+  long long local_iter = iter;
   unsigned long long next_random = (long long)id;
-  real f, g;
+  struct model *m = &model[0];
   clock_t now;
-  real *neu1 = (real *)calloc(layer1_size, sizeof(real));
-  real *neu1e = (real *)calloc(layer1_size, sizeof(real));
+  real *neu1e = (real *)calloc(m->layer1_size, sizeof(real));
 
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+  struct corpus_reader cr;
+  OpenCorpus(&cr, file_size / (long long)num_threads * (long long)id, shard_num - 1);
   IndexOfPair = (long long *)calloc(2, sizeof(long long)); // 0 is word_id, 1 is feature_id
 
   while (1) {
@@ -530,206 +1546,148 @@ void *TrainModelThread(void *id) {
       last_word_count = word_count;
       if ((debug_mode > 1)) {
         now = clock();
-        printf("\rAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", alpha,
+        printf("\rAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", m->alpha,
           word_count_actual / (real)(iter * train_words + 1) * 100,
           word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
         fflush(stdout);
       }
-      alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
-      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+      m->alpha = m->starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
+      if (m->alpha < m->starting_alpha * 0.0001) m->alpha = m->starting_alpha * 0.0001;
     }
     if (sentence_length == 0) {
       while (1) {
-        if (feature_mode == 1) {  //feature
-          ReadItemIndex(fi, IndexOfPair);
+        if (feature_mode & 1) {  //feature
+          ReadItemIndex(&cr, IndexOfPair);
           word = IndexOfPair[0];
           feature = IndexOfPair[1];
         }
-        else word = ReadWordIndex(fi);
-        if (feof(fi)) break;
+        else word = ReadWordIndex(&cr);
+        if (cr.eof) break;
         if (word == -1) continue;
         word_count++;
         if (word == 0) break;
         // The subsampling randomly discards frequent words while keeping the ranking same
-        if (sample > 0) {
-          real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
+        if (m->sample > 0) {
+          real ran = (sqrt(vocab[word].cn / (m->sample * train_words)) + 1) * (m->sample * train_words) / vocab[word].cn;
           next_random = next_random * (unsigned long long)25214903917 + 11;
           if (ran < (next_random & 0xFFFF) / (real)65536) continue;
         }
         sen[sentence_length] = word;
-        if (feature_mode == 1) sen_pos[sentence_length] = feature; //feature
+        if (feature_mode & 1) sen_pos[sentence_length] = feature; //feature
         sentence_length++;
         if (sentence_length >= MAX_SENTENCE_LENGTH) break;
       }
       sentence_position = 0;
     }
-    if (feof(fi) || (word_count > train_words / num_threads)) {
+    if (cr.eof || (word_count > train_words / num_threads)) {
       word_count_actual += word_count - last_word_count;
       local_iter--;
       if (local_iter == 0) break;
       word_count = 0;
       last_word_count = 0;
       sentence_length = 0;
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+      CloseCorpus(&cr);
+      OpenCorpus(&cr, file_size / (long long)num_threads * (long long)id, shard_num - 1);
       continue;
     }
-    word = sen[sentence_position];
+    TrainWord(m, sen, sen_pos, sentence_length, sentence_position, &next_random, neu1e);
 
-    if (word == -1) continue;
-    if (feature_mode == 1) feature = sen_pos[sentence_position]; //feature
-
-    for (c = 0; c < layer1_size; c++) neu1[c] = 0;
-    for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    b = next_random % window;
-
-    //train skip-gram
-    for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-      c = sentence_position - window + a;
-      if (c < 0) continue;
-      if (c >= sentence_length) continue;
-      last_word = sen[c];
-      if (last_word == -1) continue;
-      l1 = last_word * layer1_size;
-      for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-      // NEGATIVE SAMPLING
-      if (negative > 0) {
-        for (d = 0; d < negative + 1; d++) {
-          if (d == 0) {
-            target = word;
-            label = 1;
-          }
-          else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = table[(next_random >> 16) % table_size];
-            if (target == 0) target = next_random % (vocab_size - 1 - NumberOfFeature) + 1;
-            if (target == word) continue;
-            label = 0;
-          }
-          l2 = target * layer1_size;
-          f = 0;
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
-          if (f >= MAX_EXP) g = (label - 1) * alpha;
-          else if (f <= -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
-        }
-        // Learn weights input from hidden
-        for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
-      }
+    sentence_position++;
+    if (sentence_position >= sentence_length) {
+      sentence_length = 0;
+      continue;
     }
+  }
+  CloseCorpus(&cr);
+  free(neu1e);
+  pthread_exit(NULL);
+  return NULL;
+}
 
-    if (feature_mode == 1) {
-
-      if (feature != _NULL) {
-
-        l1 = word * layer1_size;
-        for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-
-        //center word predict self-feature
-        for (d = 0; d < negative + 1; d++) {
-          if (d == 0) {
-            target = feature;
-            label = 1;
-          }
-          else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = Ftable[(next_random >> 16) % table_size];
-            if (target == feature) continue;
-            label = 0;
-          }
-          l2 = target * layer1_size;
-          f = 0;
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
-          if (f >= MAX_EXP) g = (label - 1) * alpha;
-          else if (f <= -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
-        }
+// Trains all the models of a sweep; every sentence is read once and then subsampled and trained per model
+void *TrainSweepThread(void *id) {
+  long long word, sentence_length = 0, feature = 0, *IndexOfPair;
+  long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1], sen_pos[MAX_SENTENCE_LENGTH + 1];
+  long long local_iter = iter, max_layer1_size = 0;
+  unsigned long long next_random = (long long)id;
+  int m;
+  clock_t now;
+  struct corpus_reader cr;
 
-        // Learn weights input from hidden
-        for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
+  for (m = 0; m < model_num; m++) if (model[m].layer1_size > max_layer1_size) max_layer1_size = model[m].layer1_size;
+  real *neu1e = (real *)calloc(max_layer1_size, sizeof(real));
+  OpenCorpus(&cr, file_size / (long long)num_threads * (long long)id, shard_num - 1);
+  IndexOfPair = (long long *)calloc(2, sizeof(long long)); // 0 is word_id, 1 is feature_id
 
+  while (1) {
+    if (word_count - last_word_count > 10000) {
+      word_count_actual += word_count - last_word_count;
+      last_word_count = word_count;
+      if ((debug_mode > 1)) {
+        now = clock();
+        printf("\rAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", model[0].alpha,
+          word_count_actual / (real)(iter * train_words + 1) * 100,
+          word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
+        fflush(stdout);
+      }
+      for (m = 0; m < model_num; m++) {
+        model[m].alpha = model[m].starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
+        if (model[m].alpha < model[m].starting_alpha * 0.0001) model[m].alpha = model[m].starting_alpha * 0.0001;
       }
     }
-    else if (feature_mode == 2) {
-
-      l1 = word * layer1_size;
-      for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-
-      struct Node *temp;
-      //center word predict self-feature
-      temp = vocab[word].List;
-      while (temp != NULL) {
-        long long feature = temp->item;
-        for (d = 0; d < negative + 1; d++) {
-          if (d == 0) {
-            target = feature;
-            label = 1;
-          }
-          else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = Ftable[(next_random >> 16) % table_size];
-            if (target == feature) continue;
-            label = 0;
-          }
-          l2 = target * layer1_size;
-          f = 0;
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
-          if (f > MAX_EXP) g = (label - 1) * alpha;
-          else if (f < -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
-        }
-        temp = temp->next;
+    // Read a sentence once for all the models
+    while (1) {
+      if (feature_mode & 1) {  //feature
+        ReadItemIndex(&cr, IndexOfPair);
+        word = IndexOfPair[0];
+        feature = IndexOfPair[1];
       }
-
-      // Learn weights input from hidden
-      for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
-
+      else word = ReadWordIndex(&cr);
+      if (cr.eof) break;
+      if (word == -1) continue;
+      word_count++;
+      if (word == 0) break;
+      sen[sentence_length] = word;
+      if (feature_mode & 1) sen_pos[sentence_length] = feature; //feature
+      sentence_length++;
+      if (sentence_length >= MAX_SENTENCE_LENGTH) break;
     }
-
-    sentence_position++;
-    if (sentence_position >= sentence_length) {
+    if (cr.eof || (word_count > train_words / num_threads)) {
+      word_count_actual += word_count - last_word_count;
+      local_iter--;
+      if (local_iter == 0) break;
+      word_count = 0;
+      last_word_count = 0;
       sentence_length = 0;
+      CloseCorpus(&cr);
+      OpenCorpus(&cr, file_size / (long long)num_threads * (long long)id, shard_num - 1);
       continue;
     }
+    for (m = 0; m < model_num; m++) TrainSentence(&model[m], sen, sen_pos, sentence_length, &next_random, neu1e);
+    sentence_length = 0;
   }
-  fclose(fi);
-  free(neu1);
+  CloseCorpus(&cr);
   free(neu1e);
   pthread_exit(NULL);
   return NULL;
 }
 
-void TrainModel() {
-  long a, b, c, d;
-  FILE *fo, *fo_i, *fo_o;
-  pthread_t *pt = (pthread_t *)malloc((num_threads) * sizeof(pthread_t));
-  printf("Starting training using file %s\n", train_file);
-  starting_alpha = alpha;
-  if (read_vocab_file[0] != 0) ReadVocab();
-  else LearnVocabFromTrainFile();
-  if (save_vocab_file[0] != 0) SaveVocab();
-  if (output_file[0] == 0) return;
-  InitNet();
-  if (negative > 0) InitUnigramTable();
-  start = clock();
-
-  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
-  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
-  printf("\n");
+// Returns whether a model trains the vectors of a feature head; head 0 is the words
+int ModelUsesHead(struct model *m, int head) {
+  if (head == 0) return 1;
+  if ((feature_mode & 1) && head == 1) return m->feature_mode & 1;
+  return (m->feature_mode & 2) != 0;
+}
 
+void SaveModel(struct model *m) {
+  long long a, b, layer1_size = m->layer1_size, rows = 0;
+  FILE *fo_i, *fo_o;
   char inputvec[MAX_STRING] = {'\0'};
   char outputvec[MAX_STRING] = {'\0'};
 
-  strcat(inputvec, output_file);
+  strcat(inputvec, m->output_file);
   strcat(inputvec, ".syn0");
-  strcat(outputvec, output_file);
+  strcat(outputvec, m->output_file);
   strcat(outputvec, ".syn1neg");
 
   fo_i = fopen(inputvec, "wb");
@@ -739,25 +1697,51 @@ void TrainModel() {
   fprintf(fo_i, "%lld %lld\n", vocab_size - NumberOfFeature, layer1_size);
   for (a = 0; a < vocab_size - NumberOfFeature; a++) {
     fprintf(fo_i, "%s ", vocab[a].word);
-    if (binary) for (b = 0; b < layer1_size; b++) fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo_i);
-    else for (b = 0; b < layer1_size; b++) fprintf(fo_i, "%lf ", syn0[a * layer1_size + b]);
+    if (binary) for (b = 0; b < layer1_size; b++) fwrite(&m->syn0[a * layer1_size + b], sizeof(real), 1, fo_i);
+    else for (b = 0; b < layer1_size; b++) fprintf(fo_i, "%lf ", m->syn0[a * layer1_size + b]);
     fprintf(fo_i, "\n");
   }
 
   fclose(fo_i);
 
-  // Save the word vectors(syn1neg)
-  fprintf(fo_o, "%lld %lld\n", vocab_size, layer1_size);
+  // Save the word vectors(syn1neg) of the words and the features trained by the model
+  for (a = 0; a < vocab_size; a++) if (ModelUsesHead(m, vocab[a].isFeature)) rows++;
+  fprintf(fo_o, "%lld %lld\n", rows, layer1_size);
   for (a = 0; a < vocab_size; a++) {
+    if (!ModelUsesHead(m, vocab[a].isFeature)) continue;
     fprintf(fo_o, "%s ", vocab[a].word);
-    if (binary) for (b = 0; b < layer1_size; b++) fwrite(&syn1neg[a * layer1_size + b], sizeof(real), 1, fo_o);
-    else for (b = 0; b < layer1_size; b++) fprintf(fo_o, "%lf ", syn1neg[a * layer1_size + b]);
+    if (binary) for (b = 0; b < layer1_size; b++) fwrite(&m->syn1neg[a * layer1_size + b], sizeof(real), 1, fo_o);
+    else for (b = 0; b < layer1_size; b++) fprintf(fo_o, "%lf ", m->syn1neg[a * layer1_size + b]);
     fprintf(fo_o, "\n");
   }
 
   fclose(fo_o);
 }
 
+void TrainModel() {
+  long a;
+  int m, negative = 0;
+  pthread_t *pt = (pthread_t *)malloc((num_threads) * sizeof(pthread_t));
+  printf("Starting training using file %s\n", train_file);
+  FindTrainShards();
+  if (read_vocab_file[0] != 0) ReadVocab();
+  else LearnVocabFromTrainFile();
+  if (save_vocab_file[0] != 0) SaveVocab();
+  if (model[0].output_file[0] == 0) return;
+  for (m = 0; m < model_num; m++) {
+    InitNet(&model[m]);
+    if (model[m].negative > negative) negative = model[m].negative;
+  }
+  if (negative > 0) InitUnigramTable();
+  start = clock();
+
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, model_num > 1 ? TrainSweepThread : TrainModelThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  printf("\n");
+
+  for (m = 0; m < model_num; m++) SaveModel(&model[m]);
+}
+
 int ArgPos(char *str, int argc, char **argv) {
   int a;
   for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
@@ -770,6 +1754,67 @@ int ArgPos(char *str, int argc, char **argv) {
   return -1;
 }
 
+// Sets the hyper-parameters of a model from the options, defaulting to those of the command line
+void InitModel(struct model *m, int argc, char **argv) {
+  int i;
+  strcpy(m->output_file, output_file);
+  m->layer1_size = layer1_size;
+  m->window = window;
+  m->negative = negative;
+  m->feature_mode = feature_mode;
+  m->sample = sample;
+  m->alpha = alpha;
+  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(m->output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-size", argc, argv)) > 0) m->layer1_size = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-window", argc, argv)) > 0) m->window = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) m->negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-fmode", argc, argv)) > 0) m->feature_mode = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) m->sample = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) m->alpha = atof(argv[i + 1]);
+  m->starting_alpha = m->alpha;
+}
+
+// Reads the models of the sweep mode; each line of the sweep file holds the options of a model
+void ReadSweep() {
+  char line[MAX_STRING * 4], *args[MAX_STRING];
+  char *options[] = {"-output", "-size", "-window", "-negative", "-fmode", "-sample", "-alpha"};
+  int argc, a, b, m;
+  FILE *fin = fopen(sweep_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: sweep file not found!\n");
+    exit(1);
+  }
+  while (fgets(line, MAX_STRING * 4, fin) != NULL) {
+    argc = 1;
+    args[argc] = strtok(line, " \t\r\n");
+    while (args[argc] != NULL && argc < MAX_STRING - 1) args[++argc] = strtok(NULL, " \t\r\n");
+    if (argc == 1) continue;
+    for (a = 1; a < argc; a += 2) {
+      for (b = 0; b < sizeof(options) / sizeof(options[0]); b++) if (!strcmp(args[a], options[b])) break;
+      if (b == sizeof(options) / sizeof(options[0])) {
+        printf("ERROR: unknown option %s in sweep file!\n", args[a]);
+        exit(1);
+      }
+      if (a == argc - 1) {
+        printf("Argument missing for %s\n", args[a]);
+        exit(1);
+      }
+    }
+    model = (struct model *)realloc(model, (model_num + 1) * sizeof(struct model));
+    InitModel(&model[model_num], argc, args);
+    for (m = 0; m < model_num; m++) if (!strcmp(model[m].output_file, model[model_num].output_file)) {
+      printf("ERROR: every model of the sweep needs its own -output!\n");
+      exit(1);
+    }
+    model_num++;
+  }
+  fclose(fin);
+  if (model_num == 0) {
+    printf("ERROR: sweep file has no model!\n");
+    exit(1);
+  }
+}
+
 int main(int argc, char **argv) {
   int i;
   if (argc == 1) {
@@ -777,7 +1822,8 @@ int main(int argc, char **argv) {
     printf("Options:\n");
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
-    printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tUse text data from <file> to train the model; "
+              "<file> may also be a directory, a glob pattern or @<list of files>, and may be gzip compressed\n");
     printf("\t-output <file>\n");
     printf("\t\tUse <file> to save the resulting word vectors / word clusters\n");
     printf("\t-size <int>\n");
@@ -805,12 +1851,33 @@ int main(int argc, char **argv) {
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t-binary-vocab <int>\n");
+    printf("\t\tSave the vocabulary as a binary snapshot, which -read-vocab loads without rebuilding; "
+              "default is 0 (off)\n");
     printf("\t-fmode <int>\n");
     printf("\t\tEnable the Feature mode (default = 0 = only using skip-gram, "
                                                   "1 = predicting self-feature of sequential feature tag, "
-                                                  "2 = predicting self-feature of global feature table)\n");
-    printf("\t-knfile <file>\n");
-    printf("\t\tThe sense-words file will be read from <file>\n");
+                                                  "2 = predicting self-feature of global feature table, "
+                                                  "3 = both 1 and 2 in a single pass)\n");
+    printf("\t-knfile <file>[,<file>...]\n");
+    printf("\t\tThe sense-words file will be read from <file>; "
+              "several comma-separated files are trained as separate feature heads\n");
+    printf("\t-compile-knfile <file>\n");
+    printf("\t\tCompile the sense-words file given by -knfile into a binary sense table <file> and exit; "
+              "<file> can be used as -knfile for faster startup\n");
+    printf("\t-mmap-dir <dir>\n");
+    printf("\t\tKeep only the vectors of the frequent words and of the features in memory, and page the others "
+              "from scratch files in <dir>; for vocabularies larger than memory\n");
+    printf("\t-hot-rows <int>\n");
+    printf("\t\tNumber of the most frequent words whose vectors stay in memory with -mmap-dir; default is 100000\n");
+    printf("\t-sweep <file>\n");
+    printf("\t\tTrain several models from a single read of the training data; each line of <file> holds the "
+              "-output, -size, -window, -negative, -fmode, -sample and -alpha options of a model, "
+              "defaulting to those of the command line\n");
+    printf("\t-hugepage <int>\n");
+    printf("\t\tBack the model matrices and sampling tables with huge pages (default = 0 = off, "
+                                                  "1 = transparent huge pages, 2 = explicit 2MB pages, "
+                                                  "3 = explicit 1GB pages); falls back to smaller pages if unavailable\n");
     printf("\nExamples:\n");
     printf("%s -train data.txt -output vec.txt -size 200 -window 5 -sample 1e-4 -negative 5 -binary 0 "
               "-fmode 2 -knfile senses.txt -iter 3\n\n", argv[0]);
@@ -823,6 +1890,7 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-binary-vocab", argc, argv)) > 0) binary_vocab = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
@@ -834,8 +1902,37 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-fmode", argc, argv)) > 0) feature_mode = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *)"-knfile", argc, argv)) > 0) strcpy(knowledge_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-knfile", argc, argv)) > 0) {
+    char *file = strtok(argv[i + 1], ",");
+    while (file != NULL) {
+      if (NumberOfKnowledgeFile >= MAX_HEAD - 1) {
+        printf("ERROR: too many knowledge files!\n");
+        exit(1);
+      }
+      strcpy(knowledge_file[NumberOfKnowledgeFile++], file);
+      file = strtok(NULL, ",");
+    }
+  }
+  if ((i = ArgPos((char *)"-hugepage", argc, argv)) > 0) hugepage_mode = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-mmap-dir", argc, argv)) > 0) strcpy(mmap_dir, argv[i + 1]);
+  if ((i = ArgPos((char *)"-hot-rows", argc, argv)) > 0) hot_rows = atoll(argv[i + 1]);
 
+  if ((i = ArgPos((char *)"-compile-knfile", argc, argv)) > 0) strcpy(compile_knowledge_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-sweep", argc, argv)) > 0) strcpy(sweep_file, argv[i + 1]);
+  if (sweep_file[0] != 0) ReadSweep();
+  else {
+    model = (struct model *)calloc(1, sizeof(struct model));
+    InitModel(&model[0], 1, argv);
+    model_num = 1;
+  }
+  // The vocabulary holds the features of all the models
+  for (i = 0; i < model_num; i++) feature_mode |= model[i].feature_mode;
+  // A binary vocabulary snapshot holds the knowledge links, so it can go without -knfile; ReadVocab checks the text ones
+  if ((feature_mode & 2) && NumberOfKnowledgeFile == 0 && read_vocab_file[0] == 0) {
+    printf("ERROR: KnowledgeFile not found!\n");
+    exit(1);
+  }
+  NumberOfHead = (feature_mode & 1) + ((feature_mode & 2) ? NumberOfKnowledgeFile : 0);
   vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
   vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
   expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
@@ -843,6 +1940,10 @@ int main(int argc, char **argv) {
     expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP); // Precompute the exp() table
     expTable[i] = expTable[i] / (expTable[i] + 1);                   // Precompute f(x) = x / (x + 1)
   }
+  if (compile_knowledge_file[0] != 0) {
+    CompileKnowledge();
+    return 0;
+  }
   TrainModel();
   return 0;
 }